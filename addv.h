@@ -0,0 +1,121 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+
+#include "kernel_builder.h"
+
+
+// The column pointers of one addv call, loaded from the three Vector structs.
+struct AddvColumns {
+    llvm::Value *arg1_values, *arg1_null;
+    llvm::Value *arg2_values, *arg2_null;
+    llvm::Value *result_values, *result_null;
+};
+
+// Number of `elem_Ty` lanes in one vector register of the target `func` is compiled for.
+inline unsigned vectorWidth(llvm::TargetMachine* machine, llvm::Function* func, llvm::Type* elem_Ty) {
+    unsigned register_bits = machine->getTargetTransformInfo(*func).getRegisterBitWidth(true);
+    return std::max(1u, register_bits / elem_Ty->getPrimitiveSizeInBits());
+}
+
+/* Emits addv over rows [0, n) with explicit <W x T> vector types:
+
+    for (i = 0; i + W <= n; i += W) {
+        valid = !arg1_null[i:i+W] & !arg2_null[i:i+W];
+        result_values[i:i+W] = arg1_values[i:i+W] + arg2_values[i:i+W]   (masked by valid)
+        result_null[i:i+W] = !valid;
+    }
+    tail: the same body once more, every load/store masked by i + lane < n
+
+   The values are read and written with llvm.masked.load/store under `valid`,
+   so null rows of result_values are left untouched, as in the scalar kernel.
+   If n is a constant, the tail is only emitted when n % W != 0.
+*/
+inline void emitAddvSimd(llvm::IRBuilder<>& builder, const AddvColumns& columns,
+                         llvm::Value* n, unsigned width) {
+    llvm::LLVMContext &context = builder.getContext();
+    auto *func = builder.GetInsertBlock()->getParent();
+    auto *value_Ty = columns.arg1_values->getType()->getPointerElementType();
+    auto *values_vec_Ty = llvm::VectorType::get(value_Ty, width);
+    auto *null_vec_Ty = llvm::VectorType::get(builder.getInt8Ty(), width);
+    unsigned values_align = value_Ty->getPrimitiveSizeInBits() / 8;
+    unsigned null_align = 1;
+    auto *zero_null = llvm::ConstantAggregateZero::get(null_vec_Ty);
+    auto *zero_values = llvm::ConstantAggregateZero::get(values_vec_Ty);
+    std::vector<llvm::Constant*> Lanes;
+    for (unsigned lane = 0; lane < width; ++lane) {
+        Lanes.push_back(llvm::ConstantInt::get(n->getType(), lane));
+    }
+    auto *lane_ids = llvm::ConstantVector::get(Lanes);
+
+    // Emits one W-wide step at i. With tail_mask == nullptr every lane is in
+    // range and the null columns are accessed with plain vector loads/stores.
+    auto emitLanes = [&](llvm::Value* i, llvm::Value* tail_mask) {
+        auto *idx = builder.CreateSExt(i, builder.getInt64Ty(), "idx");
+        auto lanePtr = [&](llvm::Value* column, llvm::Type* vec_Ty) {
+            auto *column_i_ptr = builder.CreateInBoundsGEP(column, idx);
+            return builder.CreateBitCast(column_i_ptr, vec_Ty->getPointerTo(0));
+        };
+        auto loadNull = [&](llvm::Value* column, const char* name) -> llvm::Value* {
+            auto *ptr = lanePtr(column, null_vec_Ty);
+            if (!tail_mask) {
+                return builder.CreateAlignedLoad(ptr, null_align, name);
+            }
+            return builder.CreateMaskedLoad(ptr, null_align, tail_mask, zero_null, name);
+        };
+        auto *arg1_null_i = loadNull(columns.arg1_null, "arg1_null_i");
+        auto *arg2_null_i = loadNull(columns.arg2_null, "arg2_null_i");
+        auto *any_null = builder.CreateOr(arg1_null_i, arg2_null_i, "any_null");
+        auto *is_null = builder.CreateICmpNE(any_null, zero_null, "is_null");
+        llvm::Value *valid = builder.CreateNot(is_null, "valid");
+        if (tail_mask) {
+            valid = builder.CreateAnd(valid, tail_mask, "valid");
+        }
+        auto *arg1_values_i = builder.CreateMaskedLoad(lanePtr(columns.arg1_values, values_vec_Ty),
+            values_align, valid, zero_values, "arg1_values_i");
+        auto *arg2_values_i = builder.CreateMaskedLoad(lanePtr(columns.arg2_values, values_vec_Ty),
+            values_align, valid, zero_values, "arg2_values_i");
+        auto *sum = value_Ty->isFloatingPointTy()
+            ? builder.CreateFAdd(arg1_values_i, arg2_values_i, "sum")
+            : builder.CreateAdd(arg1_values_i, arg2_values_i, "sum");
+        builder.CreateMaskedStore(sum, lanePtr(columns.result_values, values_vec_Ty), values_align, valid);
+        auto *result_null_i = builder.CreateZExt(is_null, null_vec_Ty, "result_null_i");
+        if (!tail_mask) {
+            builder.CreateAlignedStore(result_null_i, lanePtr(columns.result_null, null_vec_Ty), null_align);
+        } else {
+            builder.CreateMaskedStore(result_null_i, lanePtr(columns.result_null, null_vec_Ty), null_align, tail_mask);
+        }
+    };
+
+    auto *step = llvm::ConstantInt::get(n->getType(), width);
+    auto *full = builder.CreateSub(n, builder.CreateSRem(n, step), "full");
+    createCountedLoop(builder, llvm::ConstantInt::get(n->getType(), 0), full, step, {},
+        [&](llvm::Value* i, const std::vector<llvm::Value*>&) -> std::vector<llvm::Value*> {
+            emitLanes(i, nullptr);
+            return {};
+        });
+    auto emitTail = [&]() {
+        auto *tail_lanes = builder.CreateAdd(builder.CreateVectorSplat(width, full), lane_ids, "tail_lanes");
+        auto *tail_mask = builder.CreateICmpSLT(tail_lanes, builder.CreateVectorSplat(width, n), "tail_mask");
+        emitLanes(full, tail_mask);
+    };
+    if (auto *count = llvm::dyn_cast<llvm::ConstantInt>(n)) {
+        if (count->getSExtValue() % width) {
+            emitTail();
+        }
+        return;
+    }
+    auto *tail = llvm::BasicBlock::Create(context, "tail", func);
+    auto *aftertail = llvm::BasicBlock::Create(context, "aftertail", func);
+    builder.CreateCondBr(builder.CreateICmpSLT(full, n, "tail_cond"), tail, aftertail);
+    builder.SetInsertPoint(tail);
+    emitTail();
+    builder.CreateBr(aftertail);
+    builder.SetInsertPoint(aftertail);
+}
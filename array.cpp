@@ -17,6 +17,8 @@
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Analysis/BasicAliasAnalysis.h"
 
+#include "kernel_builder.h"
+
 
 llvm::Function* createSumFunction(llvm::Module* module) {
     /* Builds the following function:
@@ -43,44 +45,18 @@ llvm::Function* createSumFunction(llvm::Module* module) {
     for (auto& arg : fooFunc->args()) {
         Args.push_back(&arg);
     }
-    auto *l2 = llvm::BasicBlock::Create(context, "", fooFunc);
-    auto *l7 = llvm::BasicBlock::Create(context, "", fooFunc);
-    auto *l11 = llvm::BasicBlock::Create(context, "", fooFunc);
-    auto *l19 = llvm::BasicBlock::Create(context, "", fooFunc);
-    auto *l22 = llvm::BasicBlock::Create(context, "", fooFunc);
-    builder.SetInsertPoint(l2);
-    llvm::Value *p3 = builder.CreateAlloca(builder.getInt32Ty()->getPointerTo(0), 0, nullptr, "");
-    llvm::Value *p4 = builder.CreateAlloca(builder.getInt32Ty(), 0, nullptr, "");
-    llvm::Value *p5 = builder.CreateAlloca(builder.getInt32Ty(), 0, nullptr, "");
-    llvm::Value *p6 = builder.CreateAlloca(builder.getInt32Ty(), 0, nullptr, "");
-    builder.CreateStore(Args[0], p3);
-    builder.CreateStore(Args[1], p4);
-    builder.CreateStore(llvm::ConstantInt::get(builder.getInt32Ty(), 0), p5);
-    builder.CreateStore(llvm::ConstantInt::get(builder.getInt32Ty(), 0), p6);
-    builder.CreateBr(l7);
-    builder.SetInsertPoint(l7);
-    llvm::Value *p8 = builder.CreateLoad(p6);
-    llvm::Value *p9 = builder.CreateLoad(p4);
-    llvm::Value *p10 = builder.CreateICmpSLT(p8, p9);
-    builder.CreateCondBr(p10, l11, l22);
-    builder.SetInsertPoint(l11);
-    llvm::Value *p12 = builder.CreateLoad(p3);
-    llvm::Value *p13 = builder.CreateLoad(p6);
-    llvm::Value *p14 = builder.CreateSExt(p13, builder.getInt64Ty());
-    llvm::Value *p15 = builder.CreateInBoundsGEP(p12, p14);
-    llvm::Value *p16 = builder.CreateLoad(p15);
-    llvm::Value *p17 = builder.CreateLoad(p5);
-    llvm::Value *p18 = builder.CreateAdd(p17, p16);
-    builder.CreateStore(p18, p5);
-    builder.CreateBr(l19);
-    builder.SetInsertPoint(l19);
-    llvm::Value *p20 = builder.CreateLoad(p6);
-    llvm::Value *p21 = builder.CreateAdd(p20, llvm::ConstantInt::get(builder.getInt32Ty(), 1));
-    builder.CreateStore(p21, p6);
-    builder.CreateBr(l7);
-    builder.SetInsertPoint(l22);
-    llvm::Value *p23 = builder.CreateLoad(p5);
-    builder.CreateRet(p23);
+    auto *entry = llvm::BasicBlock::Create(context, "entry", fooFunc);
+    builder.SetInsertPoint(entry);
+    auto Results = createCountedLoop(builder,
+        llvm::ConstantInt::get(builder.getInt32Ty(), 0), Args[1],
+        llvm::ConstantInt::get(builder.getInt32Ty(), 1),
+        {llvm::ConstantInt::get(builder.getInt32Ty(), 0)},
+        [&](llvm::Value* i, const std::vector<llvm::Value*>& Carried) -> std::vector<llvm::Value*> {
+            auto *a_i_ptr = builder.CreateInBoundsGEP(Args[0], builder.CreateSExt(i, builder.getInt64Ty()));
+            auto *a_i = builder.CreateLoad(a_i_ptr, "a_i");
+            return {builder.CreateAdd(Carried[0], a_i, "result")};
+        });
+    builder.CreateRet(Results[0]);
     llvm::verifyFunction(*fooFunc);
     return fooFunc;
 };
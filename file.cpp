@@ -14,6 +14,7 @@
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/Host.h"
 #include "llvm/ExecutionEngine/GenericValue.h"
 #include "llvm/ADT/APInt.h"
 
@@ -21,6 +22,9 @@
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Analysis/BasicAliasAnalysis.h"
 
+#include "kernel_builder.h"
+#include "addv.h"
+
 #define VECSIZE 50
 #define VECTYPE double // int
 
@@ -70,98 +74,109 @@ llvm::Function* createAddvFunction(llvm::Module* module) {
         Args[ArgNames[arg.getArgNo()]] = &arg;
     }
     auto *entry = llvm::BasicBlock::Create(context, "entry", fooFunc);
-    auto *loop_check = llvm::BasicBlock::Create(context, "loop_check", fooFunc);
-    auto *loop = llvm::BasicBlock::Create(context, "loop", fooFunc);
-    auto *afterloop = llvm::BasicBlock::Create(context, "afterloop", fooFunc);
-    auto *increment = llvm::BasicBlock::Create(context, "increment", fooFunc);
-    auto *second_cond_label = llvm::BasicBlock::Create(context, "second_cond_label", fooFunc);
-    auto *if_label = llvm::BasicBlock::Create(context, "if_label", fooFunc);
-    auto *else_label = llvm::BasicBlock::Create(context, "else_label", fooFunc);
     builder.SetInsertPoint(entry);
-    auto *iptr = builder.CreateAlloca(builder.getInt32Ty(), 0, nullptr, "iptr");
-    builder.CreateStore(llvm::ConstantInt::get(builder.getInt32Ty(), 0), iptr);
-    builder.CreateBr(loop_check);
-    builder.SetInsertPoint(loop_check);
-    auto *i = builder.CreateLoad(iptr, "i");
-    auto *loop_cond = builder.CreateICmpSLT(i, llvm::ConstantInt::get(builder.getInt32Ty(), VECSIZE), "loop_cond");
-    builder.CreateCondBr(loop_cond, loop, afterloop);
-    builder.SetInsertPoint(loop);
-    auto *result_null_ptr = builder.CreateInBoundsGEP(Args["result"], 
-        {
-            llvm::ConstantInt::get(builder.getInt32Ty(), 0), 
-            llvm::ConstantInt::get(builder.getInt32Ty(), 1)
+    auto *arg1_values = loadStructField(builder, Args["arg1"], 0, "arg1_values");
+    auto *arg1_null = loadStructField(builder, Args["arg1"], 1, "arg1_null");
+    auto *arg2_values = loadStructField(builder, Args["arg2"], 0, "arg2_values");
+    auto *arg2_null = loadStructField(builder, Args["arg2"], 1, "arg2_null");
+    auto *result_values = loadStructField(builder, Args["result"], 0, "result_values");
+    auto *result_null = loadStructField(builder, Args["result"], 1, "result_null");
+    createCountedLoop(builder,
+        llvm::ConstantInt::get(builder.getInt32Ty(), 0),
+        llvm::ConstantInt::get(builder.getInt32Ty(), VECSIZE),
+        llvm::ConstantInt::get(builder.getInt32Ty(), 1),
+        {},
+        [&](llvm::Value* i, const std::vector<llvm::Value*>&) -> std::vector<llvm::Value*> {
+            auto *second_cond_label = llvm::BasicBlock::Create(context, "second_cond_label", fooFunc);
+            auto *if_label = llvm::BasicBlock::Create(context, "if_label", fooFunc);
+            auto *else_label = llvm::BasicBlock::Create(context, "else_label", fooFunc);
+            auto *increment = llvm::BasicBlock::Create(context, "increment", fooFunc);
+            auto *idx = builder.CreateSExt(i, builder.getInt64Ty(), "idx");
+            auto *result_null_i_ptr = builder.CreateInBoundsGEP(result_null, idx, "result_null_i_ptr");
+            auto *arg1_null_i = builder.CreateLoad(builder.CreateInBoundsGEP(arg1_null, idx), "arg1_null_i");
+            auto *first_cond = builder.CreateICmpNE(arg1_null_i, llvm::ConstantInt::get(builder.getInt8Ty(), 0), "first_cond");
+            builder.CreateCondBr(first_cond, else_label, second_cond_label);
+            builder.SetInsertPoint(second_cond_label);
+            auto *arg2_null_i = builder.CreateLoad(builder.CreateInBoundsGEP(arg2_null, idx), "arg2_null_i");
+            auto *second_cond = builder.CreateICmpNE(arg2_null_i, llvm::ConstantInt::get(builder.getInt8Ty(), 0), "second_cond");
+            builder.CreateCondBr(second_cond, else_label, if_label);
+            builder.SetInsertPoint(if_label);
+            builder.CreateStore(llvm::ConstantInt::get(builder.getInt8Ty(), 0), result_null_i_ptr);
+            auto *arg1_values_i = builder.CreateLoad(builder.CreateInBoundsGEP(arg1_values, idx), "arg1_values_i");
+            auto *arg2_values_i = builder.CreateLoad(builder.CreateInBoundsGEP(arg2_values, idx), "arg2_values_i");
+            auto *result_values_i_ptr = builder.CreateInBoundsGEP(result_values, idx);
+            llvm::Value *sum = nullptr;
+            if constexpr (std::is_same_v<VECTYPE, int>) {
+                sum = builder.CreateAdd(arg1_values_i, arg2_values_i, "sum");
+            } else if constexpr (std::is_same_v<VECTYPE, double>) {
+                sum = builder.CreateFAdd(arg1_values_i, arg2_values_i, "sum");
+            }
+            builder.CreateStore(sum, result_values_i_ptr);
+            builder.CreateBr(increment);
+            builder.SetInsertPoint(else_label);
+            builder.CreateStore(llvm::ConstantInt::get(builder.getInt8Ty(), 1), result_null_i_ptr);
+            builder.CreateBr(increment);
+            builder.SetInsertPoint(increment);
+            return {};
         });
-    auto *result_null = builder.CreateLoad(result_null_ptr);
-    auto *result_null_i_ptr = builder.CreateInBoundsGEP(result_null, i, "result_null_i_ptr");
+    builder.CreateRetVoid();
+    llvm::verifyFunction(*fooFunc);
+    return fooFunc;
+};
 
-    auto *arg1_null_ptr = builder.CreateInBoundsGEP(Args["arg1"], 
-        {
-            llvm::ConstantInt::get(builder.getInt32Ty(), 0), 
-            llvm::ConstantInt::get(builder.getInt32Ty(), 1)
-        });
-    auto *arg1_null = builder.CreateLoad(arg1_null_ptr);
-    auto *arg1_null_i_ptr = builder.CreateInBoundsGEP(arg1_null, i);
-    auto *arg1_null_i = builder.CreateLoad(arg1_null_i_ptr, "arg1_null_i");
-    auto *first_cond = builder.CreateICmpNE(arg1_null_i, llvm::ConstantInt::get(builder.getInt8Ty(), 0), "first_cond");
-    builder.CreateCondBr(first_cond, else_label, second_cond_label);
-    builder.SetInsertPoint(second_cond_label);
-    auto *arg2_null_ptr = builder.CreateInBoundsGEP(Args["arg2"], 
-        {
-            llvm::ConstantInt::get(builder.getInt32Ty(), 0), 
-            llvm::ConstantInt::get(builder.getInt32Ty(), 1)
-        });
-    auto *arg2_null = builder.CreateLoad(arg2_null_ptr);
-    auto *arg2_null_i_ptr = builder.CreateInBoundsGEP(arg2_null, i);
-    auto *arg2_null_i = builder.CreateLoad(arg2_null_i_ptr, "arg2_null_i");
-    auto *second_cond = builder.CreateICmpNE(arg2_null_i, llvm::ConstantInt::get(builder.getInt8Ty(), 0), "second_cond");
-    builder.CreateCondBr(second_cond, else_label, if_label);
-    builder.SetInsertPoint(if_label);
-    builder.CreateStore(llvm::ConstantInt::get(builder.getInt8Ty(), 0), result_null_i_ptr);
-    auto *arg1_values_ptr = builder.CreateInBoundsGEP(Args["arg1"], 
-        {
-            llvm::ConstantInt::get(builder.getInt32Ty(), 0), 
-            llvm::ConstantInt::get(builder.getInt32Ty(), 0)
-        });
-    auto *arg1_values = builder.CreateLoad(arg1_values_ptr);
-    auto *arg1_values_i_ptr = builder.CreateInBoundsGEP(arg1_values, i);
-    auto *arg1_values_i = builder.CreateLoad(arg1_values_i_ptr, "arg1_values_i");
-    auto *arg2_values_ptr = builder.CreateInBoundsGEP(Args["arg2"], 
-        {
-            llvm::ConstantInt::get(builder.getInt32Ty(), 0), 
-            llvm::ConstantInt::get(builder.getInt32Ty(), 0)
-        });
-    auto *arg2_values = builder.CreateLoad(arg2_values_ptr);
-    auto *arg2_values_i_ptr = builder.CreateInBoundsGEP(arg2_values, i);
-    auto *arg2_values_i = builder.CreateLoad(arg2_values_i_ptr, "arg2_values_i");
-    auto *result_values_ptr = builder.CreateInBoundsGEP(Args["result"], 
-        {
-            llvm::ConstantInt::get(builder.getInt32Ty(), 0), 
-            llvm::ConstantInt::get(builder.getInt32Ty(), 0)
-        });
-    auto *result_values = builder.CreateLoad(result_values_ptr);
-    auto *result_values_i_ptr = builder.CreateInBoundsGEP(result_values, i);
-    llvm::Value *sum = nullptr;
+llvm::Function* createAddvSimdFunction(llvm::Module* module, llvm::TargetMachine* machine) {
+    /* Builds the same addv as createAddvFunction, but with explicit vector types:
+    see emitAddvSimd in addv.h. W is taken from the target's vector register
+    width, so the kernel is SIMD whether or not the optimizer would have
+    vectorized the scalar loop.
+    */
+    llvm::LLVMContext &context = module->getContext();
+    llvm::IRBuilder<> builder(context);
+    llvm::Type *value_Ty = nullptr;
     if constexpr (std::is_same_v<VECTYPE, int>) {
-        sum = builder.CreateAdd(arg1_values_i, arg2_values_i, "sum");
+        value_Ty = builder.getInt32Ty();
     } else if constexpr (std::is_same_v<VECTYPE, double>) {
-        sum = builder.CreateFAdd(arg1_values_i, arg2_values_i, "sum");
+        value_Ty = builder.getDoubleTy();
+    }
+    llvm::Type *struct_values = llvm::PointerType::get(value_Ty, 0);
+    llvm::Type *struct_null = llvm::PointerType::get(builder.getInt8Ty(), 0);
+    llvm::StructType *struct_Ty = module->getTypeByName("Vector");
+    if (!struct_Ty) {
+        struct_Ty = llvm::StructType::create(context, "Vector");
+        struct_Ty->setBody({struct_values, struct_null});
+    }
+    std::vector<llvm::Type*> ArgTypes = {struct_Ty->getPointerTo(0), struct_Ty->getPointerTo(0), struct_Ty->getPointerTo(0)};
+    std::vector<std::string> ArgNames = {"arg1", "arg2", "result"};
+    auto *funcType = llvm::FunctionType::get(builder.getVoidTy(), ArgTypes, false);
+    auto *fooFunc = llvm::Function::Create(
+        funcType, llvm::Function::ExternalLinkage, "addv_simd", module
+    );
+    std::unordered_map<std::string, llvm::Value*> Args;
+    for (auto& arg : fooFunc->args()) {
+        arg.setName(ArgNames[arg.getArgNo()]);
+        Args[ArgNames[arg.getArgNo()]] = &arg;
     }
-    builder.CreateStore(sum, result_values_i_ptr);
-    builder.CreateBr(increment);
-    builder.SetInsertPoint(else_label);
-    builder.CreateStore(llvm::ConstantInt::get(builder.getInt8Ty(), 1), result_null_i_ptr);
-    builder.CreateBr(increment);
-    builder.SetInsertPoint(increment);
-    auto *inc = builder.CreateAdd(i, llvm::ConstantInt::get(builder.getInt32Ty(), 1), "inc");
-    builder.CreateStore(inc, iptr);
-    builder.CreateBr(loop_check);
-    builder.SetInsertPoint(afterloop);
+
+    auto *entry = llvm::BasicBlock::Create(context, "entry", fooFunc);
+    builder.SetInsertPoint(entry);
+    AddvColumns columns = {
+        loadStructField(builder, Args["arg1"], 0, "arg1_values"),
+        loadStructField(builder, Args["arg1"], 1, "arg1_null"),
+        loadStructField(builder, Args["arg2"], 0, "arg2_values"),
+        loadStructField(builder, Args["arg2"], 1, "arg2_null"),
+        loadStructField(builder, Args["result"], 0, "result_values"),
+        loadStructField(builder, Args["result"], 1, "result_null"),
+    };
+    emitAddvSimd(builder, columns, llvm::ConstantInt::get(builder.getInt32Ty(), VECSIZE),
+                 vectorWidth(machine, fooFunc, value_Ty));
     builder.CreateRetVoid();
     llvm::verifyFunction(*fooFunc);
     return fooFunc;
 };
 
 int main(int argc, char* argv[]) {
+    // ./exec.out --simd also builds addv from explicit vector types and checks it against the scalar loop
+    bool simd = argc > 1 && std::string(argv[1]) == "--simd";
     llvm::TargetOptions Opts;
     llvm::InitializeNativeTarget();
     llvm::InitializeNativeTargetAsmPrinter();
@@ -172,14 +187,27 @@ int main(int argc, char* argv[]) {
 
     std::unique_ptr<llvm::RTDyldMemoryManager> MemMgr(new llvm::SectionMemoryManager());
 
+    // Target the host CPU and the features it actually enables, so the vector
+    // width the SIMD kernel is built for matches the instructions emitted.
+    llvm::StringMap<bool> HostFeatures;
+    std::vector<std::string> MAttrs;
+    if (llvm::sys::getHostCPUFeatures(HostFeatures)) {
+        for (auto& feature : HostFeatures) {
+            MAttrs.push_back((feature.getValue() ? "+" : "-") + feature.getKey().str());
+        }
+    }
+
     llvm::EngineBuilder factory(std::move(myModule));
     factory.setEngineKind(llvm::EngineKind::JIT);
     factory.setTargetOptions(Opts);
+    factory.setMCPU(llvm::sys::getHostCPUName());
+    factory.setMAttrs(MAttrs);
     factory.setMCJITMemoryManager(std::move(MemMgr));
     auto executionEngine = std::unique_ptr<llvm::ExecutionEngine>(factory.create());
     module->setDataLayout(executionEngine->getDataLayout());
 
     auto* func = createAddvFunction(module);
+    auto* simd_func = simd ? createAddvSimdFunction(module, executionEngine->getTargetMachine()) : nullptr;
 
     llvm::outs() << "We just constructed this LLVM module:\n\n" << *module;
     llvm::outs() << "\n\nRunning foo: ";
@@ -187,12 +215,14 @@ int main(int argc, char* argv[]) {
 
     auto* raw_ptr = executionEngine->getPointerToFunction(func);
     auto* func_ptr = (void(*)(Vector*, Vector*, Vector*))raw_ptr;
+    auto* simd_func_ptr = simd ? (void(*)(Vector*, Vector*, Vector*))executionEngine->getPointerToFunction(simd_func) : nullptr;
     executionEngine->finalizeObject();
 
     // Execute
     Vector arg1 = (Vector){.values = (VECTYPE*)std::calloc(VECSIZE, sizeof(VECTYPE)), .null = (char*)std::calloc(VECSIZE, sizeof(char))};
     Vector arg2 = (Vector){.values = (VECTYPE*)std::calloc(VECSIZE, sizeof(VECTYPE)), .null = (char*)std::calloc(VECSIZE, sizeof(char))};
     Vector res0 = (Vector){.values = (VECTYPE*)std::calloc(VECSIZE, sizeof(VECTYPE)), .null = (char*)std::calloc(VECSIZE, sizeof(char))};
+    Vector res1 = (Vector){.values = (VECTYPE*)std::calloc(VECSIZE, sizeof(VECTYPE)), .null = (char*)std::calloc(VECSIZE, sizeof(char))};
     std::srand(123);
     for (int i = 0; i < VECSIZE; ++i) {
         arg1.values[i] = std::rand() % 100;
@@ -206,6 +236,22 @@ int main(int argc, char* argv[]) {
         std::cout << "(" << arg2.values[i] << ", " << (int)arg2.null[i] << ") = ";
         std::cout << "(" << res0.values[i] << ", " << (int)res0.null[i] << ")\n";
     }
-    
+
+    if (simd) {
+        // The SIMD kernel must agree with the scalar one: same nulls everywhere, same values on non-null lanes
+        simd_func_ptr(&arg1, &arg2, &res1);
+        int mismatches = 0;
+        for (int i = 0; i < VECSIZE; ++i) {
+            if (res0.null[i] != res1.null[i] || (!res0.null[i] && res0.values[i] != res1.values[i])) {
+                std::cout << "simd mismatch at " << i << ": (" << res1.values[i] << ", " << (int)res1.null[i] << ")\n";
+                ++mismatches;
+            }
+        }
+        if (mismatches) {
+            return 1;
+        }
+        std::cout << "simd kernel matches scalar kernel\n";
+    }
+
     return 0;
 }
\ No newline at end of file
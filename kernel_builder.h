@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cassert>
+#include <string>
+#include <vector>
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/DerivedTypes.h"
+
+
+/* Helpers for building kernels directly in SSA form.
+
+   The clang -O0 style (alloca per variable, reload on every use) has to be
+   cleaned up by mem2reg/GVN before any real optimization can start. Kernels
+   built with these helpers keep induction variables and accumulators in phi
+   nodes and load struct fields once, so there is nothing left to clean up.
+*/
+
+// Loads field `index` of the struct `struct_ptr` points to, e.g. vec->values.
+// Call it in the entry block so the load is not repeated in the loop.
+inline llvm::Value* loadStructField(llvm::IRBuilder<>& builder, llvm::Value* struct_ptr,
+                                    int index, const std::string& name = "") {
+    auto *field_ptr = builder.CreateInBoundsGEP(struct_ptr,
+        {
+            llvm::ConstantInt::get(builder.getInt32Ty(), 0),
+            llvm::ConstantInt::get(builder.getInt32Ty(), index)
+        });
+    return builder.CreateLoad(field_ptr, name);
+}
+
+/* Builds the following loop at the current insert point:
+
+    carried = inits;
+    for (i = begin; i < end; i += step) {
+        carried = body(i, carried);
+    }
+
+   `body` is called with the builder positioned inside the loop and may create
+   its own blocks; the loop is closed from wherever the builder is left. It
+   returns the new values of `carried`, which are threaded through phi nodes.
+   On return the builder is positioned after the loop and the final values of
+   `carried` are returned.
+*/
+template <typename Body>
+std::vector<llvm::Value*> createCountedLoop(llvm::IRBuilder<>& builder,
+                                            llvm::Value* begin, llvm::Value* end, llvm::Value* step,
+                                            const std::vector<llvm::Value*>& inits, Body body,
+                                            const std::string& name = "loop") {
+    llvm::LLVMContext &context = builder.getContext();
+    auto *func = builder.GetInsertBlock()->getParent();
+    auto *preheader = builder.GetInsertBlock();
+    auto *loop_check = llvm::BasicBlock::Create(context, name + "_check", func);
+    auto *loop = llvm::BasicBlock::Create(context, name, func);
+    auto *afterloop = llvm::BasicBlock::Create(context, "after" + name, func);
+    builder.CreateBr(loop_check);
+
+    builder.SetInsertPoint(loop_check);
+    auto *i = builder.CreatePHI(begin->getType(), 2, "i");
+    i->addIncoming(begin, preheader);
+    std::vector<llvm::PHINode*> Carried;
+    for (auto *init : inits) {
+        auto *phi = builder.CreatePHI(init->getType(), 2);
+        phi->addIncoming(init, preheader);
+        Carried.push_back(phi);
+    }
+    auto *loop_cond = builder.CreateICmpSLT(i, end, name + "_cond");
+    builder.CreateCondBr(loop_cond, loop, afterloop);
+
+    builder.SetInsertPoint(loop);
+    std::vector<llvm::Value*> Current(Carried.begin(), Carried.end());
+    std::vector<llvm::Value*> Next = body(i, Current);
+    assert(Next.size() == Carried.size() && "body must return one value per carried value");
+    auto *inc = builder.CreateAdd(i, step, "inc");
+    auto *latch = builder.GetInsertBlock();
+    builder.CreateBr(loop_check);
+    i->addIncoming(inc, latch);
+    for (size_t k = 0; k < Carried.size(); ++k) {
+        Carried[k]->addIncoming(Next[k], latch);
+    }
+
+    builder.SetInsertPoint(afterloop);
+    return Current;
+}
@@ -17,6 +17,8 @@
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Analysis/BasicAliasAnalysis.h"
 
+#include "kernel_builder.h"
+
 
 llvm::Function* createMulFunction(llvm::Module* module) {
     /* Builds the following function:
@@ -44,40 +46,16 @@ llvm::Function* createMulFunction(llvm::Module* module) {
     for (auto& arg : fooFunc->args()) {
         Args.push_back(&arg);
     }
-    auto *l2 = llvm::BasicBlock::Create(context, "", fooFunc);
-    auto *l7 = llvm::BasicBlock::Create(context, "", fooFunc);
-    auto *l11 = llvm::BasicBlock::Create(context, "", fooFunc);
-    auto *l15 = llvm::BasicBlock::Create(context, "", fooFunc);
-    auto *l18 = llvm::BasicBlock::Create(context, "", fooFunc);
-    builder.SetInsertPoint(l2);
-    llvm::Value *p3 = builder.CreateAlloca(builder.getInt32Ty(), 0, nullptr, "");
-    llvm::Value *p4 = builder.CreateAlloca(builder.getInt32Ty(), 0, nullptr, "");
-    llvm::Value *p5 = builder.CreateAlloca(builder.getInt32Ty(), 0, nullptr, "");
-    llvm::Value *p6 = builder.CreateAlloca(builder.getInt32Ty(), 0, nullptr, "");
-    builder.CreateStore(Args[0], p3);
-    builder.CreateStore(Args[1], p4);
-    builder.CreateStore(llvm::ConstantInt::get(builder.getInt32Ty(), 0), p5);
-    builder.CreateStore(llvm::ConstantInt::get(builder.getInt32Ty(), 0), p6);
-    builder.CreateBr(l7);
-    builder.SetInsertPoint(l7);
-    llvm::Value *p8 = builder.CreateLoad(p6);
-    llvm::Value *p9 = builder.CreateLoad(p4);
-    llvm::Value *p10 = builder.CreateICmpSLT(p8, p9);
-    builder.CreateCondBr(p10, l11, l18);
-    builder.SetInsertPoint(l11);
-    llvm::Value *p12 = builder.CreateLoad(p3);
-    llvm::Value *p13 = builder.CreateLoad(p5);
-    llvm::Value *p14 = builder.CreateAdd(p13, p12);
-    builder.CreateStore(p14, p5);
-    builder.CreateBr(l15);
-    builder.SetInsertPoint(l15);
-    llvm::Value *p16 = builder.CreateLoad(p6);
-    llvm::Value *p17 = builder.CreateAdd(p16, llvm::ConstantInt::get(builder.getInt32Ty(), 1));
-    builder.CreateStore(p17, p6);
-    builder.CreateBr(l7);
-    builder.SetInsertPoint(l18);
-    llvm::Value *p19 = builder.CreateLoad(p5);
-    builder.CreateRet(p19);
+    auto *entry = llvm::BasicBlock::Create(context, "entry", fooFunc);
+    builder.SetInsertPoint(entry);
+    auto Results = createCountedLoop(builder,
+        llvm::ConstantInt::get(builder.getInt32Ty(), 0), Args[1],
+        llvm::ConstantInt::get(builder.getInt32Ty(), 1),
+        {llvm::ConstantInt::get(builder.getInt32Ty(), 0)},
+        [&](llvm::Value* i, const std::vector<llvm::Value*>& Carried) -> std::vector<llvm::Value*> {
+            return {builder.CreateAdd(Carried[0], Args[0], "result")};
+        });
+    builder.CreateRet(Results[0]);
     llvm::verifyFunction(*fooFunc);
     return fooFunc;
 };
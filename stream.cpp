@@ -0,0 +1,352 @@
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <type_traits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/Host.h"
+#include "llvm/ExecutionEngine/GenericValue.h"
+#include "llvm/ADT/APInt.h"
+
+// Optimizations
+#include "llvm/Transforms/Scalar.h"
+#include "llvm/Analysis/BasicAliasAnalysis.h"
+
+#include "kernel_builder.h"
+#include "addv.h"
+
+#define BATCHSIZE 65536
+#define VECTYPE double // int
+
+typedef struct {
+    VECTYPE* values;
+    char* null;
+} Vector;
+
+/* Input is a stream of column batches, each
+       int32 n, n x VECTYPE value1, n x VECTYPE value2, n x char null1, n x char null2
+   with 0 < n <= BATCHSIZE, so every column is read straight into its Vector.
+   Output mirrors it, one batch per input batch:
+       int32 n, n x VECTYPE value, n x char null
+   where the value of a null row is unspecified. With --text the output is
+   one "value null" line per row instead, with 0 as the value of null rows.
+*/
+
+
+llvm::Function* createAddvSimdFunction(llvm::Module* module, llvm::TargetMachine* machine) {
+    /* Builds addv over one batch of n rows:
+
+    void addv_simd(Vector *vec1, Vector *vec2, Vector *result, int n) {
+        for (int i = 0; i < n; i++) {
+            if (!vec1->null[i] && !vec2->null[i]) {
+                result->values[i] = vec1->values[i] + vec2->values[i];
+                result->null[i] = 0;
+            } else {
+                result->null[i] = 1;
+            }
+        }
+    }
+
+    with the explicit vector body from emitAddvSimd in addv.h.
+
+    compile with:
+    # clang++-8 `llvm-config-8 --cxxflags --ldflags --libs` -std=c++17 stream.cpp -lpthread -o exec.out
+    */
+    llvm::LLVMContext &context = module->getContext();
+    llvm::IRBuilder<> builder(context);
+    llvm::Type *value_Ty = nullptr;
+    if constexpr (std::is_same_v<VECTYPE, int>) {
+        value_Ty = builder.getInt32Ty();
+    } else if constexpr (std::is_same_v<VECTYPE, double>) {
+        value_Ty = builder.getDoubleTy();
+    }
+    llvm::Type *struct_values = llvm::PointerType::get(value_Ty, 0);
+    llvm::Type *struct_null = llvm::PointerType::get(builder.getInt8Ty(), 0);
+    llvm::StructType *struct_Ty = llvm::StructType::create(context, "Vector");
+    struct_Ty->setBody({struct_values, struct_null});
+    std::vector<llvm::Type*> ArgTypes = {struct_Ty->getPointerTo(0), struct_Ty->getPointerTo(0), struct_Ty->getPointerTo(0), builder.getInt32Ty()};
+    std::vector<std::string> ArgNames = {"arg1", "arg2", "result", "n"};
+    auto *funcType = llvm::FunctionType::get(builder.getVoidTy(), ArgTypes, false);
+    auto *fooFunc = llvm::Function::Create(
+        funcType, llvm::Function::ExternalLinkage, "addv_simd", module
+    );
+    std::unordered_map<std::string, llvm::Value*> Args;
+    for (auto& arg : fooFunc->args()) {
+        arg.setName(ArgNames[arg.getArgNo()]);
+        Args[ArgNames[arg.getArgNo()]] = &arg;
+    }
+    auto *entry = llvm::BasicBlock::Create(context, "entry", fooFunc);
+    builder.SetInsertPoint(entry);
+    AddvColumns columns = {
+        loadStructField(builder, Args["arg1"], 0, "arg1_values"),
+        loadStructField(builder, Args["arg1"], 1, "arg1_null"),
+        loadStructField(builder, Args["arg2"], 0, "arg2_values"),
+        loadStructField(builder, Args["arg2"], 1, "arg2_null"),
+        loadStructField(builder, Args["result"], 0, "result_values"),
+        loadStructField(builder, Args["result"], 1, "result_null"),
+    };
+    emitAddvSimd(builder, columns, Args["n"], vectorWidth(machine, fooFunc, value_Ty));
+    builder.CreateRetVoid();
+    llvm::verifyFunction(*fooFunc);
+    return fooFunc;
+};
+
+Vector allocVector(size_t size) {
+    return (Vector){.values = (VECTYPE*)std::calloc(size, sizeof(VECTYPE)), .null = (char*)std::calloc(size, sizeof(char))};
+}
+
+// One pipeline slot; count == 0 marks the end of the stream.
+struct Batch {
+    Vector arg1 = allocVector(BATCHSIZE);
+    Vector arg2 = allocVector(BATCHSIZE);
+    Vector result = allocVector(BATCHSIZE);
+    int32_t count = 0;
+};
+
+// Hands batch slots from one pipeline stage to the next.
+class BatchQueue {
+public:
+    void push(Batch* batch) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            batches.push_back(batch);
+        }
+        ready.notify_one();
+    }
+
+    Batch* pop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        ready.wait(lock, [this] { return !batches.empty(); });
+        Batch* batch = batches.front();
+        batches.pop_front();
+        return batch;
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<Batch*> batches;
+};
+
+[[noreturn]] void fail(const std::string& message) {
+    std::cerr << "stream: " << message << "\n";
+    std::exit(1);
+}
+
+void readColumn(std::FILE* in, void* column, size_t bytes) {
+    if (std::fread(column, 1, bytes, in) != bytes) {
+        fail(std::ferror(in) ? "read error" : "truncated batch at end of input");
+    }
+}
+
+// Reads the next batch into `batch`; sets count to 0 at end of input.
+void readBatch(std::FILE* in, Batch* batch) {
+    int32_t count = 0;
+    size_t got = std::fread(&count, 1, sizeof(count), in);
+    if (got != sizeof(count)) {
+        if (std::ferror(in)) {
+            fail("read error");
+        }
+        if (got != 0) {
+            fail("truncated batch header at end of input");
+        }
+        batch->count = 0;
+        return;
+    }
+    if (count <= 0 || count > BATCHSIZE) {
+        fail("batch size " + std::to_string(count) + " is outside 1.." + std::to_string(BATCHSIZE));
+    }
+    readColumn(in, batch->arg1.values, count * sizeof(VECTYPE));
+    readColumn(in, batch->arg2.values, count * sizeof(VECTYPE));
+    readColumn(in, batch->arg1.null, count);
+    readColumn(in, batch->arg2.null, count);
+    batch->count = count;
+}
+
+// Writes result batches; binary columns go straight to fwrite, text is formatted into a large buffer first.
+class Writer {
+public:
+    Writer(std::FILE* out, bool text) : out(out), text(text), buffer(1 << 20) {}
+
+    void write(const Vector& result, int32_t count) {
+        if (!text) {
+            writeBytes(&count, sizeof(count));
+            writeBytes(result.values, count * sizeof(VECTYPE));
+            writeBytes(result.null, count);
+            return;
+        }
+        for (int32_t i = 0; i < count; ++i) {
+            if (buffer.size() - used < 64) {
+                flush();
+            }
+            writeText(result.null[i] ? 0 : result.values[i], result.null[i]);
+        }
+    }
+
+    void flush() {
+        writeBytes(buffer.data(), used);
+        used = 0;
+        if (std::fflush(out) != 0) {
+            fail("write error");
+        }
+    }
+
+private:
+    void writeBytes(const void* data, size_t bytes) {
+        if (std::fwrite(data, 1, bytes, out) != bytes) {
+            fail("write error");
+        }
+    }
+
+    void writeText(VECTYPE value, char null) {
+        if constexpr (std::is_same_v<VECTYPE, int>) {
+            char digits[16];
+            unsigned magnitude = value < 0 ? 0u - (unsigned)value : (unsigned)value;
+            int len = 0;
+            do {
+                digits[len++] = '0' + magnitude % 10;
+                magnitude /= 10;
+            } while (magnitude);
+            if (value < 0) {
+                buffer[used++] = '-';
+            }
+            while (len) {
+                buffer[used++] = digits[--len];
+            }
+        } else {
+            // 17 significant digits round-trip every double
+            used += std::snprintf(&buffer[used], buffer.size() - used, "%.17g", value);
+        }
+        buffer[used++] = ' ';
+        buffer[used++] = null ? '1' : '0';
+        buffer[used++] = '\n';
+    }
+
+    std::FILE* out;
+    bool text;
+    std::vector<char> buffer;
+    size_t used = 0;
+};
+
+int main(int argc, char* argv[]) {
+    // ./exec.out [--text] [input]   (input defaults to stdin, output goes to stdout)
+    bool text = false;
+    const char* input = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        if (std::string(argv[i]) == "--text") {
+            text = true;
+        } else {
+            input = argv[i];
+        }
+    }
+    std::FILE* in = stdin;
+    if (input && std::string(input) != "-") {
+        in = std::fopen(input, "rb");
+        if (!in) {
+            fail(std::string("cannot open ") + input);
+        }
+    }
+
+    llvm::TargetOptions Opts;
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+
+    llvm::LLVMContext context;
+    auto myModule = std::make_unique<llvm::Module>("My First JIT", context);
+    auto* module = myModule.get();
+
+    std::unique_ptr<llvm::RTDyldMemoryManager> MemMgr(new llvm::SectionMemoryManager());
+
+    // Target the host CPU and the features it actually enables, so the vector
+    // width the kernel is built for matches the instructions emitted.
+    llvm::StringMap<bool> HostFeatures;
+    std::vector<std::string> MAttrs;
+    if (llvm::sys::getHostCPUFeatures(HostFeatures)) {
+        for (auto& feature : HostFeatures) {
+            MAttrs.push_back((feature.getValue() ? "+" : "-") + feature.getKey().str());
+        }
+    }
+
+    llvm::EngineBuilder factory(std::move(myModule));
+    factory.setEngineKind(llvm::EngineKind::JIT);
+    factory.setTargetOptions(Opts);
+    factory.setMCPU(llvm::sys::getHostCPUName());
+    factory.setMAttrs(MAttrs);
+    factory.setMCJITMemoryManager(std::move(MemMgr));
+    auto executionEngine = std::unique_ptr<llvm::ExecutionEngine>(factory.create());
+    module->setDataLayout(executionEngine->getDataLayout());
+
+    auto* func = createAddvSimdFunction(module, executionEngine->getTargetMachine());
+
+    // stdout carries the results, so the module goes to stderr
+    llvm::errs() << "We just constructed this LLVM module:\n\n" << *module;
+    llvm::errs().flush();
+
+    auto* raw_ptr = executionEngine->getPointerToFunction(func);
+    auto* func_ptr = (void(*)(Vector*, Vector*, Vector*, int))raw_ptr;
+    executionEngine->finalizeObject();
+
+    // Execute: a reader thread, this thread and a writer thread pass two
+    // batch slots around, so reading, computing and writing overlap.
+    Batch batches[2];
+    BatchQueue empty, filled, computed;
+    for (auto& batch : batches) {
+        empty.push(&batch);
+    }
+    std::thread reader([&] {
+        for (;;) {
+            Batch* batch = empty.pop();
+            readBatch(in, batch);
+            filled.push(batch);
+            if (batch->count == 0) {
+                return;
+            }
+        }
+    });
+    std::thread writer_thread([&] {
+        Writer writer(stdout, text);
+        for (;;) {
+            Batch* batch = computed.pop();
+            if (batch->count == 0) {
+                writer.flush();
+                return;
+            }
+            writer.write(batch->result, batch->count);
+            empty.push(batch);
+        }
+    });
+    for (;;) {
+        Batch* batch = filled.pop();
+        if (batch->count != 0) {
+            func_ptr(&batch->arg1, &batch->arg2, &batch->result, batch->count);
+        }
+        computed.push(batch);
+        if (batch->count == 0) {
+            break;
+        }
+    }
+    reader.join();
+    writer_thread.join();
+
+    if (in != stdin) {
+        std::fclose(in);
+    }
+    return 0;
+}